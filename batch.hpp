@@ -0,0 +1,796 @@
+#ifndef FP_BATCH_HPP
+#define FP_BATCH_HPP
+
+#include <algorithm>
+#include <cerrno>
+#include <chrono>
+#include <condition_variable>
+#include <cstdint>
+#include <cstdio>
+#include <cstring>
+#include <deque>
+#include <exception>
+#include <iostream>
+#include <limits>
+#include <map>
+#include <mutex>
+#include <stdexcept>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include "fixed_point.hpp"
+
+namespace fp {
+
+    namespace batch {
+
+        // what a solver did with a single record
+        enum status : std::int32_t {
+            converged = 0,
+            not_converged = 1, // hit maxiter, lost the bracket or produced a non-finite iterate
+            invalid = 2        // the record could not be parsed or names an unknown function
+        };
+
+        enum class method { newton, secant, bisection };
+
+        enum class format { csv, binary };
+
+        // one problem. For newton only a is used (x0), for secant a and b
+        // are x0 and x1, for bisection they are the bracket [a, b].
+        struct record
+        {
+            double a;
+            double b;
+            double abstol;
+            std::int32_t func;
+            std::int32_t maxiter;
+        };
+
+        struct result
+        {
+            double root;
+            std::int32_t iters;
+            std::int32_t status;
+        };
+
+        // the binary formats are the structs above written back to back
+        // in native byte order, so make sure there is no padding in them
+        static_assert(sizeof(record) == 32, "binary input records must be 32 bytes");
+        static_assert(sizeof(result) == 16, "binary output records must be 16 bytes");
+
+        // longest csv line (including a trailing '\r') a record can have
+        const std::size_t max_line = 255;
+
+        // largest --chunk, which keeps a chunk's buffer at a few tens of megabytes
+        const std::size_t max_chunk = 1 << 20;
+
+        struct options
+        {
+            method solver = method::newton;
+            format in_format = format::csv;
+            format out_format = format::csv;
+            std::string input = "-";
+            std::string output = "-";
+            double abstol = 5e-10;
+            int maxiter = 80;
+            unsigned threads = 0;       // 0 means std::thread::hardware_concurrency()
+            std::size_t chunk = 1 << 14; // records per binary chunk, lines per csv chunk (roughly)
+            bool help = false;           // --help was given, print usage instead of running
+        };
+
+        // the functions records can refer to by index (1 based, like their names)
+        inline double (*function(std::int32_t index))(double)
+        {
+            using namespace newton;
+            static double (* const table[])(double) {f1, f2, f3, f4, f5};
+            if (index < 1 || index > 5) {
+                return nullptr;
+            }
+            return table[index - 1];
+        }
+
+        // the solvers below do the same iterations as newton_method, secant_method
+        // and bisection_method but only keep the current iterate, since
+        // allocating the whole history for every record is far too slow here
+        inline result newton_root(double (*f)(double), double x0, double abstol, int maxiter)
+        {
+            double x = x0;
+            for (auto i = 1; i <= maxiter; ++i)
+            {
+                double next = x - (f(x) / derivative(*f, x));
+                if (!std::isfinite(next)) {
+                    return {next, i, not_converged};
+                }
+                if (std::abs(next - x) <= abstol) {
+                    return {next, i, converged};
+                }
+                x = next;
+            }
+            return {x, maxiter, not_converged};
+        }
+
+        inline result secant_root(double (*f)(double), double x0, double x1, double abstol, int maxiter)
+        {
+            double f0 = f(x0);
+            double f1 = f(x1);
+            for (auto i = 1; i <= maxiter; ++i)
+            {
+                double next = x1 - f1 * ((x1 - x0) / (f1 - f0));
+                if (!std::isfinite(next)) {
+                    return {next, i, not_converged};
+                }
+                if (std::abs(next - x1) <= abstol) {
+                    return {next, i, converged};
+                }
+                x0 = x1;
+                f0 = f1;
+                x1 = next;
+                f1 = f(next);
+            }
+            return {x1, maxiter, not_converged};
+        }
+
+        inline result bisection_root(double (*f)(double), double a, double b, double abstol, int maxiter)
+        {
+            double fa = f(a);
+            double fb = f(b);
+            // sign() treats 0 as negative, so an endpoint that is a root must be checked first
+            if (fa == 0) {
+                return {a, 0, converged};
+            }
+            if (fb == 0) {
+                return {b, 0, converged};
+            }
+            if (sign(fa) == sign(fb)) {
+                return {std::numeric_limits<double>::quiet_NaN(), 0, not_converged};
+            }
+            double c = midpoint(a, b);
+            for (auto i = 1; i <= maxiter; ++i)
+            {
+                c = midpoint(a, b);
+                double fc = f(c);
+                if (fc == 0 || std::abs(b - a) / 2 < abstol) {
+                    return {c, i, converged};
+                }
+                if (sign(fc) == sign(fa)) {
+                    a = c;
+                    fa = fc;
+                } else {
+                    b = c;
+                }
+            }
+            return {c, maxiter, not_converged};
+        }
+
+        inline result solve(method m, const record& r)
+        {
+            auto f = function(r.func);
+            if (f == nullptr || r.maxiter < 1) {
+                return {std::numeric_limits<double>::quiet_NaN(), 0, invalid};
+            }
+            switch (m)
+            {
+                case method::newton:
+                    return newton_root(f, r.a, r.abstol, r.maxiter);
+                case method::secant:
+                    return secant_root(f, r.a, r.b, r.abstol, r.maxiter);
+                case method::bisection:
+                default:
+                    return bisection_root(f, r.a, r.b, r.abstol, r.maxiter);
+            }
+        }
+
+        // a blocking FIFO that holds at most `capacity` elements, which is
+        // what keeps the memory use of the pipeline independent of the input size
+        template<typename T>
+        class bounded_queue
+        {
+        public:
+            explicit bounded_queue(std::size_t capacity) : capacity(capacity) {}
+
+            // returns false if the queue was closed before there was room
+            bool push(T item)
+            {
+                std::unique_lock<std::mutex> lock(mutex);
+                not_full.wait(lock, [this] { return closed || items.size() < capacity; });
+                if (closed) {
+                    return false;
+                }
+                items.push_back(std::move(item));
+                not_empty.notify_one();
+                return true;
+            }
+
+            // returns false once the queue is closed and drained
+            bool pop(T& item)
+            {
+                std::unique_lock<std::mutex> lock(mutex);
+                not_empty.wait(lock, [this] { return closed || !items.empty(); });
+                if (items.empty()) {
+                    return false;
+                }
+                item = std::move(items.front());
+                items.pop_front();
+                not_full.notify_one();
+                return true;
+            }
+
+            void close()
+            {
+                std::lock_guard<std::mutex> lock(mutex);
+                closed = true;
+                not_full.notify_all();
+                not_empty.notify_all();
+            }
+
+        private:
+            std::mutex mutex;
+            std::condition_variable not_full;
+            std::condition_variable not_empty;
+            std::deque<T> items;
+            const std::size_t capacity;
+            bool closed = false;
+        };
+
+        // hands chunks to the writer in sequence order. A worker finishing a
+        // chunk too far ahead of the writer waits, so at most `window` chunks
+        // are ever buffered. The worker holding the next expected chunk never
+        // waits, so this can't deadlock.
+        template<typename T>
+        class reorder_buffer
+        {
+        public:
+            explicit reorder_buffer(std::size_t window) : window(window) {}
+
+            bool push(std::size_t seq, T item)
+            {
+                std::unique_lock<std::mutex> lock(mutex);
+                room.wait(lock, [&] { return closed || seq < next + window; });
+                if (closed) {
+                    return false;
+                }
+                items.emplace(seq, std::move(item));
+                if (seq == next) {
+                    ready.notify_one();
+                }
+                return true;
+            }
+
+            // returns false once the buffer is closed and the next chunk will never arrive
+            bool pop(T& item)
+            {
+                std::unique_lock<std::mutex> lock(mutex);
+                ready.wait(lock, [this] { return closed || (!items.empty() && items.begin()->first == next); });
+                if (items.empty() || items.begin()->first != next) {
+                    return false;
+                }
+                item = std::move(items.begin()->second);
+                items.erase(items.begin());
+                ++next;
+                room.notify_all();
+                return true;
+            }
+
+            void close()
+            {
+                std::lock_guard<std::mutex> lock(mutex);
+                closed = true;
+                room.notify_all();
+                ready.notify_all();
+            }
+
+        private:
+            std::mutex mutex;
+            std::condition_variable room;
+            std::condition_variable ready;
+            std::map<std::size_t, T> items;
+            const std::size_t window;
+            std::size_t next = 0;
+            bool closed = false;
+        };
+
+        struct chunk
+        {
+            std::size_t seq;
+            std::size_t records;
+            std::vector<char> bytes;
+        };
+
+        // strtol into an int32_t, failing instead of wrapping when the value doesn't fit
+        inline bool parse_int32(char* p, char*& q, std::int32_t& out)
+        {
+            errno = 0;
+            long n = std::strtol(p, &q, 10);
+            if (q == p || errno == ERANGE
+                || n < std::numeric_limits<std::int32_t>::min() || n > std::numeric_limits<std::int32_t>::max()) {
+                return false;
+            }
+            out = static_cast<std::int32_t>(n);
+            return true;
+        }
+
+        // parse "func,a[,b[,abstol[,maxiter]]]". A missing abstol or maxiter
+        // comes from the command line options. b may only be left out for
+        // newton, which has no use for it; secant and bisection need both points.
+        inline bool parse_csv(const char* begin, const char* end, const options& opts, record& r)
+        {
+            // strtod and friends need a terminated string
+            char line[max_line + 1];
+            auto len = static_cast<std::size_t>(end - begin);
+            if (len >= sizeof(line)) {
+                return false;
+            }
+            std::memcpy(line, begin, len);
+            line[len] = '\0';
+
+            r = {0, 0, opts.abstol, 0, opts.maxiter};
+            char* p = line;
+            char* q;
+            if (!parse_int32(p, q, r.func)) {
+                return false;
+            }
+
+            double* fields[] {&r.a, &r.b, &r.abstol};
+            for (auto field : fields)
+            {
+                p = q;
+                if (*p != ',') {
+                    bool optional = field == &r.abstol || (field == &r.b && opts.solver == method::newton);
+                    return *p == '\0' && optional;
+                }
+                *field = std::strtod(++p, &q);
+                if (q == p) {
+                    return false;
+                }
+            }
+            p = q;
+            if (*p == ',') {
+                if (!parse_int32(++p, q, r.maxiter)) {
+                    return false;
+                }
+            }
+            return *q == '\0';
+        }
+
+        inline void append_csv(std::vector<char>& out, const result& res)
+        {
+            char buf[64];
+            int n = std::snprintf(buf, sizeof(buf), "%.17g,%d,%d\n", res.root, res.iters, res.status);
+            out.insert(out.end(), buf, buf + n);
+        }
+
+        inline void append_binary(std::vector<char>& out, const result& res)
+        {
+            auto p = reinterpret_cast<const char*>(&res);
+            out.insert(out.end(), p, p + sizeof(res));
+        }
+
+        // turns a chunk of input bytes into a chunk of output bytes
+        inline chunk solve_chunk(const chunk& in, const options& opts)
+        {
+            chunk out {in.seq, 0, {}};
+            auto emit = [&](const result& res) {
+                if (opts.out_format == format::csv) {
+                    append_csv(out.bytes, res);
+                } else {
+                    append_binary(out.bytes, res);
+                }
+                ++out.records;
+            };
+
+            if (opts.in_format == format::binary) {
+                out.bytes.reserve(in.records * (opts.out_format == format::csv ? 32 : sizeof(result)));
+                record r;
+                for (std::size_t i = 0; i < in.records; ++i)
+                {
+                    std::memcpy(&r, in.bytes.data() + i * sizeof(record), sizeof(record));
+                    emit(solve(opts.solver, r));
+                }
+                return out;
+            }
+
+            const char* p = in.bytes.data();
+            const char* end = p + in.bytes.size();
+            while (p < end)
+            {
+                auto eol = std::find(p, end, '\n');
+                auto last = eol;
+                if (last > p && last[-1] == '\r') {
+                    --last;
+                }
+                // blank lines and '#' comments (e.g. a header) produce no output
+                if (last > p && *p != '#') {
+                    record r;
+                    if (parse_csv(p, last, opts, r)) {
+                        emit(solve(opts.solver, r));
+                    } else {
+                        emit({std::numeric_limits<double>::quiet_NaN(), 0, invalid});
+                    }
+                }
+                p = eol == end ? end : eol + 1;
+            }
+            return out;
+        }
+
+        // reads the input into chunks. Binary chunks hold a whole number of
+        // records and csv chunks end on a line boundary, so workers can
+        // process them without looking at their neighbours.
+        class reader
+        {
+        public:
+            reader(std::FILE* file, const options& opts) : file(file), opts(opts) {}
+
+            bool next(chunk& c)
+            {
+                c.seq = seq;
+                c.records = 0;
+                c.bytes.clear();
+                bool more = opts.in_format == format::binary ? next_binary(c) : next_csv(c);
+                if (more) {
+                    ++seq;
+                }
+                return more;
+            }
+
+        private:
+            bool next_binary(chunk& c)
+            {
+                c.bytes.resize(opts.chunk * sizeof(record));
+                auto n = std::fread(c.bytes.data(), 1, c.bytes.size(), file);
+                check();
+                if (n % sizeof(record) != 0) {
+                    throw std::runtime_error("binary input ends with a partial record");
+                }
+                c.bytes.resize(n);
+                c.records = n / sizeof(record);
+                return n > 0;
+            }
+
+            bool next_csv(chunk& c)
+            {
+                // start with whatever followed the last newline of the previous chunk
+                c.bytes.swap(carry);
+                carry.clear();
+                auto block = opts.chunk * 64;
+                while (!eof)
+                {
+                    auto size = c.bytes.size();
+                    c.bytes.resize(size + block);
+                    auto n = std::fread(c.bytes.data() + size, 1, block, file);
+                    check();
+                    c.bytes.resize(size + n);
+                    eof = n < block;
+
+                    auto nl = std::find(c.bytes.rbegin(), c.bytes.rend(), '\n');
+                    if (nl != c.bytes.rend()) {
+                        auto cut = c.bytes.end() - (nl - c.bytes.rbegin());
+                        carry.assign(cut, c.bytes.end());
+                        c.bytes.erase(cut, c.bytes.end());
+                        break;
+                    }
+                    // no newline yet, so everything buffered is one line. If it is
+                    // already too long to be a record, stop buffering it: emit a
+                    // line that fails to parse and drop the rest of it.
+                    if (c.bytes.size() > max_line) {
+                        static const char bad_line[] = "!\n";
+                        c.bytes.assign(bad_line, bad_line + sizeof(bad_line) - 1);
+                        skip_line(block);
+                        break;
+                    }
+                }
+                return !c.bytes.empty();
+            }
+
+            // reads up to the next newline, keeping what follows it for the next chunk
+            void skip_line(std::size_t block)
+            {
+                std::vector<char> buf(block);
+                while (!eof)
+                {
+                    auto n = std::fread(buf.data(), 1, block, file);
+                    check();
+                    eof = n < block;
+                    auto nl = std::find(buf.begin(), buf.begin() + n, '\n');
+                    if (nl != buf.begin() + n) {
+                        carry.assign(nl + 1, buf.begin() + n);
+                        return;
+                    }
+                }
+            }
+
+            void check()
+            {
+                if (std::ferror(file)) {
+                    throw std::runtime_error("error reading input");
+                }
+            }
+
+            std::FILE* file;
+            const options& opts;
+            std::vector<char> carry;
+            std::size_t seq = 0;
+            bool eof = false;
+        };
+
+        struct stats
+        {
+            std::size_t records;
+            double seconds;
+        };
+
+        // reader -> workers -> ordered writer. Every stage is connected by
+        // a bounded queue, so memory use is proportional to
+        // threads * chunk no matter how large the input is.
+        inline stats run(const options& opts)
+        {
+            std::FILE* in = opts.input == "-" ? stdin : std::fopen(opts.input.c_str(), "rb");
+            if (in == nullptr) {
+                throw std::runtime_error("can't open input file '" + opts.input + "'");
+            }
+            std::FILE* out = opts.output == "-" ? stdout : std::fopen(opts.output.c_str(), "wb");
+            if (out == nullptr) {
+                if (in != stdin) {
+                    std::fclose(in);
+                }
+                throw std::runtime_error("can't open output file '" + opts.output + "'");
+            }
+
+            auto nthreads = opts.threads != 0 ? opts.threads : std::max(1u, std::thread::hardware_concurrency());
+            bounded_queue<chunk> pending(2 * nthreads);
+            reorder_buffer<chunk> finished(2 * nthreads);
+
+            // the first exception thrown by any stage, everything shuts down after it
+            std::mutex error_mutex;
+            std::exception_ptr error;
+            auto fail = [&] {
+                {
+                    std::lock_guard<std::mutex> lock(error_mutex);
+                    if (!error) {
+                        error = std::current_exception();
+                    }
+                }
+                pending.close();
+                finished.close();
+            };
+
+            auto start = std::chrono::steady_clock::now();
+            std::size_t total = 0;
+
+            std::thread read_thread;
+            std::vector<std::thread> workers;
+            std::mutex done_mutex;
+            unsigned running = nthreads;
+
+            auto join_all = [&] {
+                if (read_thread.joinable()) {
+                    read_thread.join();
+                }
+                for (auto& w : workers)
+                {
+                    w.join();
+                }
+            };
+            auto close_files = [&] {
+                if (in != stdin) {
+                    std::fclose(in);
+                }
+                if (out != stdout) {
+                    std::fclose(out);
+                }
+            };
+
+            try {
+                read_thread = std::thread([&] {
+                    try {
+                        reader r(in, opts);
+                        chunk c;
+                        while (r.next(c))
+                        {
+                            if (!pending.push(std::move(c))) {
+                                break;
+                            }
+                            c = chunk();
+                        }
+                    } catch (...) {
+                        fail();
+                    }
+                    pending.close();
+                });
+
+                for (unsigned t = 0; t < nthreads; ++t)
+                {
+                    workers.emplace_back([&] {
+                        try {
+                            chunk c;
+                            while (pending.pop(c))
+                            {
+                                if (!finished.push(c.seq, solve_chunk(c, opts))) {
+                                    break;
+                                }
+                            }
+                        } catch (...) {
+                            fail();
+                        }
+                        // the last worker out tells the writer nothing else is coming
+                        std::lock_guard<std::mutex> lock(done_mutex);
+                        if (--running == 0) {
+                            finished.close();
+                        }
+                    });
+                }
+            } catch (...) {
+                // couldn't start every thread: shut down the ones that did start
+                fail();
+                join_all();
+                close_files();
+                throw;
+            }
+
+            // the writer runs on this thread
+            try {
+                chunk c;
+                while (finished.pop(c))
+                {
+                    if (std::fwrite(c.bytes.data(), 1, c.bytes.size(), out) != c.bytes.size()) {
+                        throw std::runtime_error("error writing output");
+                    }
+                    total += c.records;
+                }
+                if (std::fflush(out) != 0) {
+                    throw std::runtime_error("error writing output");
+                }
+            } catch (...) {
+                fail();
+            }
+
+            join_all();
+            auto seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+
+            close_files();
+            if (error) {
+                std::rethrow_exception(error);
+            }
+            return {total, seconds};
+        }
+
+        inline void usage(std::ostream& stream, const char* program)
+        {
+            stream << "usage: " << program << " batch [options] [input [output]]\n"
+                   << "\n"
+                   << "Solves one problem per input record and writes one result per record,\n"
+                   << "in input order. Input and output default to stdin and stdout ('-').\n"
+                   << "\n"
+                   << "  --method newton|secant|bisection   solver to use (default newton)\n"
+                   << "  --in csv|binary                    input format (default csv)\n"
+                   << "  --out csv|binary                   output format (default csv)\n"
+                   << "  --abstol X                         default tolerance (default 5e-10)\n"
+                   << "  --maxiter N                        default iteration limit (default 80)\n"
+                   << "  --threads N                        solver threads (default: all cores)\n"
+                   << "  --chunk N                          records per work unit (default 16384, at most 1048576)\n"
+                   << "  --help                             print this message\n"
+                   << "\n"
+                   << "csv input:     func,a[,b[,abstol[,maxiter]]]   ('#' lines are skipped,\n"
+                   << "               b is required for secant and bisection)\n"
+                   << "binary input:  double a, b, abstol; int32 func, maxiter  (32 bytes)\n"
+                   << "csv output:    root,iterations,status\n"
+                   << "binary output: double root; int32 iterations, status  (16 bytes)\n"
+                   << "\n"
+                   << "func is 1-5 for newton::f1 to f5. For newton a is x0, for secant a and b\n"
+                   << "are x0 and x1, for bisection [a, b] is the bracket. status is 0 when\n"
+                   << "converged, 1 when not converged and 2 for an invalid record.\n";
+        }
+
+        // most threads --threads accepts, per core
+        const unsigned max_threads_per_core = 8;
+
+        // parses the whole of `value` as an integer in [min, max]
+        inline long long parse_integer(const std::string& arg, const std::string& value, long long min, long long max)
+        {
+            std::size_t end = 0;
+            long long n = 0;
+            try {
+                n = std::stoll(value, &end);
+            } catch (const std::logic_error&) {
+                end = 0; // not a number or out of range, reported below
+            }
+            if (end == 0 || end != value.size() || n < min || n > max) {
+                throw std::invalid_argument(arg + " must be an integer from " + std::to_string(min)
+                                            + " to " + std::to_string(max));
+            }
+            return n;
+        }
+
+        // parses the whole of `value` as a finite, non-negative number
+        inline double parse_tolerance(const std::string& arg, const std::string& value)
+        {
+            std::size_t end = 0;
+            double x = 0;
+            try {
+                x = std::stod(value, &end);
+            } catch (const std::logic_error&) {
+                end = 0; // not a number or out of range, reported below
+            }
+            if (end == 0 || end != value.size() || !std::isfinite(x) || x < 0) {
+                throw std::invalid_argument(arg + " must be a finite, non-negative number");
+            }
+            return x;
+        }
+
+        // parses the arguments following "batch"
+        inline options parse_args(int argc, char* argv[])
+        {
+            options opts;
+            // --help wins wherever it is, even if the other arguments are wrong
+            for (auto i = 0; i < argc; ++i)
+            {
+                if (std::strcmp(argv[i], "--help") == 0) {
+                    opts.help = true;
+                    return opts;
+                }
+            }
+
+            std::vector<std::string> files;
+            for (auto i = 0; i < argc; ++i)
+            {
+                std::string arg = argv[i];
+                if (arg.size() < 3 || arg.compare(0, 2, "--") != 0) {
+                    files.push_back(arg);
+                    continue;
+                }
+                if (i + 1 >= argc) {
+                    throw std::invalid_argument("missing value for " + arg);
+                }
+                std::string value = argv[++i];
+                auto as_format = [&]() -> format {
+                    if (value == "csv") {
+                        return format::csv;
+                    }
+                    if (value == "binary") {
+                        return format::binary;
+                    }
+                    throw std::invalid_argument("unknown format '" + value + "'");
+                };
+
+                if (arg == "--method") {
+                    if (value == "newton") {
+                        opts.solver = method::newton;
+                    } else if (value == "secant") {
+                        opts.solver = method::secant;
+                    } else if (value == "bisection") {
+                        opts.solver = method::bisection;
+                    } else {
+                        throw std::invalid_argument("unknown method '" + value + "'");
+                    }
+                } else if (arg == "--in") {
+                    opts.in_format = as_format();
+                } else if (arg == "--out") {
+                    opts.out_format = as_format();
+                } else if (arg == "--abstol") {
+                    opts.abstol = parse_tolerance(arg, value);
+                } else if (arg == "--maxiter") {
+                    opts.maxiter = static_cast<int>(parse_integer(arg, value, 1, std::numeric_limits<std::int32_t>::max()));
+                } else if (arg == "--threads") {
+                    auto cores = std::max(1u, std::thread::hardware_concurrency());
+                    opts.threads = static_cast<unsigned>(parse_integer(arg, value, 0, max_threads_per_core * cores));
+                } else if (arg == "--chunk") {
+                    opts.chunk = static_cast<std::size_t>(parse_integer(arg, value, 1, max_chunk));
+                } else {
+                    throw std::invalid_argument("unknown option " + arg);
+                }
+            }
+            if (files.size() > 2) {
+                throw std::invalid_argument("too many file arguments");
+            }
+            if (files.size() > 0) {
+                opts.input = files[0];
+            }
+            if (files.size() > 1) {
+                opts.output = files[1];
+            }
+            return opts;
+        }
+    }
+}
+
+#endif
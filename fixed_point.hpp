@@ -1,6 +1,10 @@
 #pragma once
 
 #include <utility>
+#include <tuple>
+#include <functional>
+#include <string>
+#include <ctime>
 #include <vector>
 #include <cmath>
 #include <fstream>
@@ -1,10 +1,33 @@
 #include <iostream>
+#include <cstring>
 
 #include "fixed_point.hpp"
+#include "batch.hpp"
 
 const auto abstol = 5e-10;
 const auto numiters = 80;
 
-int main() {
+int main(int argc, char* argv[]) {
+    if (argc > 1 && std::strcmp(argv[1], "batch") == 0) {
+        try {
+            auto opts = fp::batch::parse_args(argc - 2, argv + 2);
+            if (opts.help) {
+                fp::batch::usage(std::cout, argv[0]);
+                return 0;
+            }
+            auto stats = fp::batch::run(opts);
+            std::cerr << stats.records << " records in " << stats.seconds << " s ("
+                      << (stats.seconds > 0 ? stats.records / stats.seconds : 0) << " records/s)" << std::endl;
+        } catch (const std::invalid_argument& e) {
+            std::cerr << "error: " << e.what() << "\n\n";
+            fp::batch::usage(std::cerr, argv[0]);
+            return 2;
+        } catch (const std::exception& e) {
+            std::cerr << "error: " << e.what() << std::endl;
+            return 1;
+        }
+        return 0;
+    }
+
     fp::test_newton_2(abstol);
-}
\ No newline at end of file
+}